@@ -9,11 +9,12 @@
 #include "disk_emu.h"
 
 /* Fixed variable declaration */
-#define MAX_FNAME_LENGTH 32       // filename length, limit to 32 for the testers
 #define BLOCK_SIZE 1024           // block size
 #define TOTAL_NUM_OF_BLOCKS 1024  // total number of blocks
 #define MAX_INODES 128            // Restricting the number of i-nodes to 128
 #define DEFAULT_DISK_NAME "Disk"  // Default disk name
+#define MAGIC_NUMBER 0xACBD0005   // magic number of the super block
+#define LAYOUT_VERSION 2          // on-disk layout version, bump whenever the block layout below changes
 #define SUPER_BLOCK_LOCATION 0  // location of the super block
 #define ROOT_DIR_INODE_LOCATION 1  // location of the root directory
 #define INODE_TABLE_LOCATION 1  // starting location of inode table
@@ -24,15 +25,27 @@
 #define DATA_BLOCK_BITMAP_SIZE 4       // size of data block bit map
 #define DIRECTORY_TABLE_LOCATION 18 // directory table starting location
 #define DIRECTORY_TABLE_SIZE 5 // size of the directory table
-#define PRE_DEFINED_BLOCKS 23 // total number of predefined blocks
+#define DATA_BLOCK_REFCOUNT_LOCATION 23 // starting location of the data block reference counts
+#define DATA_BLOCK_REFCOUNT_SIZE 4      // size of the data block reference counts
+#define MAX_SNAPSHOTS 4 // number of named snapshots we can keep
+#define SNAPSHOT_TABLE_LOCATION 27 // location of the snapshot table
+#define SNAPSHOT_DATA_LOCATION 28 // starting location of the saved inode/directory tables
+#define SNAPSHOT_SIZE 14 // INODE_TABLE_SIZE + DIRECTORY_TABLE_SIZE blocks per snapshot
+#define PRE_DEFINED_BLOCKS 84 // total number of predefined blocks
+#define MAX_DIRECTORY_CURSORS 16 // number of directory listings that can be open at once
+#define MAX_FILE_BLOCKS (12 + BLOCK_SIZE / 4) // 12 direct blocks plus the 4 byte pointers of one indirect block
 
 // structure for superblock according to manual
 typedef struct super_block {
-    int magic;
+    unsigned int magic;
     int block_size;
     int file_system_size;
     int inode_table_length;
     int root_directory;
+    int clean_unmount;  // 1 -> last session ended with sfs_unmount, free counts below can be trusted
+    int free_blocks;    // cached number of free data blocks
+    int free_inodes;    // cached number of free inodes
+    int layout_version; // LAYOUT_VERSION the disk was created with
 } SUPER_BLOCK;
 
 // structure for each inode according to manual
@@ -62,17 +75,43 @@ typedef struct open_file_descriptor {
     int write_pointer;
 } OPEN_FILE_DESCRIPTOR;
 
+// in memory cursor of an open directory listing
+typedef struct directory_cursor {
+    int in_use;
+    int position;  // next index of the directory table to look at
+} DIRECTORY_CURSOR;
+
+// snapshot table entry, 32+4 bytes
+// snapshot i keeps its tables at SNAPSHOT_DATA_LOCATION + i * SNAPSHOT_SIZE
+typedef struct snapshot_entry {
+    char name[MAX_FNAME_LENGTH];
+    int in_use;
+} SNAPSHOT_ENTRY;
+
 /* dynamic variable declaration */
 INODE inode_table[MAX_INODES];
 DIRECTORY_ENTRY directory_table[MAX_INODES];                  // directory table keeps copies of directories in memory
 OPEN_FILE_DESCRIPTOR open_file_descriptor_table[MAX_INODES];  // open file descriptor table to keep track of inodes
 SUPER_BLOCK super_block;
+SNAPSHOT_ENTRY snapshot_table[MAX_SNAPSHOTS];
+DIRECTORY_CURSOR directory_cursor_table[MAX_DIRECTORY_CURSORS];  // one cursor per open directory listing
 int current_directory = 1;
 
 /* bitmaps */
 // bitmap 1-> occupied, 0-> free
 int inode_bitmap[MAX_INODES];  // 1024 blocks possible, each entry is 4 bytes, so takes 4 blocks to store inodes
 int data_block_bitmap[TOTAL_NUM_OF_BLOCKS];
+// number of inodes (or shared indirect blocks) pointing at each data block,
+// a block is only freed once its count drops to 0
+int data_block_refcount[TOTAL_NUM_OF_BLOCKS];
+
+/* lazy loading */
+// the inode and directory tables are read one block at a time, the first time an entry
+// in that block is used, and the bitmaps on the first allocation or free,
+// so mounting only reads the super block and the snapshot table
+int inode_block_loaded[INODE_TABLE_SIZE];
+int directory_block_loaded[DIRECTORY_TABLE_SIZE];
+int bitmaps_loaded = 0;
 
 // min helper function to find the min of 2 integers
 int min(int x, int y) {
@@ -90,13 +129,146 @@ int max(int x, int y) {
     return y;
 }
 
+/* helper to write the super block, padded to a full block */
+void write_super_block() {
+    char block_buf[BLOCK_SIZE];
+    memset(block_buf, '\0', BLOCK_SIZE);
+    memcpy(block_buf, &super_block, sizeof(super_block));
+    write_blocks(SUPER_BLOCK_LOCATION, 1, block_buf);
+}
+
+/* helper to read the blocks of a table covering bytes [start, end) that are not loaded yet */
+void load_table_blocks(void* table, int table_size, int table_location, int* loaded, int start, int end) {
+    for (int b = start / BLOCK_SIZE; b <= (end - 1) / BLOCK_SIZE; b++) {
+        if (loaded[b] == 0) {
+            char block_buf[BLOCK_SIZE];
+            read_blocks(table_location + b, 1, block_buf);
+            memcpy((char*)table + b * BLOCK_SIZE, block_buf, min(BLOCK_SIZE, table_size - b * BLOCK_SIZE));
+            loaded[b] = 1;
+        }
+    }
+}
+
+/* helper to write back the loaded blocks of a table */
+// blocks that were never loaded cannot have changed, so they are skipped
+// consecutive loaded blocks are written with a single call
+void flush_table_blocks(void* table, int table_size, int table_location, int table_blocks, int* loaded) {
+    int b = 0;
+    while (b < table_blocks) {
+        if (loaded[b] == 0) {
+            b++;
+            continue;
+        }
+        int end = b;
+        while (end < table_blocks && loaded[end] == 1) {
+            end++;
+        }
+        char* run_buf = malloc((end - b) * BLOCK_SIZE);
+        memset(run_buf, '\0', (end - b) * BLOCK_SIZE);
+        memcpy(run_buf, (char*)table + b * BLOCK_SIZE, min((end - b) * BLOCK_SIZE, table_size - b * BLOCK_SIZE));
+        write_blocks(table_location + b, end - b, run_buf);
+        free(run_buf);
+        b = end;
+    }
+}
+
+/* get_inode */
+// returns the inode at index, loading its block(s) from disk if needed
+INODE* get_inode(int index) {
+    load_table_blocks(inode_table, sizeof(inode_table), INODE_TABLE_LOCATION, inode_block_loaded,
+                      index * sizeof(INODE), (index + 1) * sizeof(INODE));
+    return &inode_table[index];
+}
+
+/* get_directory_entry */
+// returns the directory entry at index, loading its block(s) from disk if needed
+DIRECTORY_ENTRY* get_directory_entry(int index) {
+    load_table_blocks(directory_table, sizeof(directory_table), DIRECTORY_TABLE_LOCATION, directory_block_loaded,
+                      index * sizeof(DIRECTORY_ENTRY), (index + 1) * sizeof(DIRECTORY_ENTRY));
+    return &directory_table[index];
+}
+
+// load the complete inode and directory tables, for operations working on whole tables
+void load_all_tables() {
+    load_table_blocks(inode_table, sizeof(inode_table), INODE_TABLE_LOCATION, inode_block_loaded,
+                      0, sizeof(inode_table));
+    load_table_blocks(directory_table, sizeof(directory_table), DIRECTORY_TABLE_LOCATION, directory_block_loaded,
+                      0, sizeof(directory_table));
+}
+
+void flush_inode_table() {
+    flush_table_blocks(inode_table, sizeof(inode_table), INODE_TABLE_LOCATION, INODE_TABLE_SIZE, inode_block_loaded);
+}
+
+void flush_directory_table() {
+    flush_table_blocks(directory_table, sizeof(directory_table), DIRECTORY_TABLE_LOCATION, DIRECTORY_TABLE_SIZE,
+                       directory_block_loaded);
+}
+
+/* load both bitmaps and the reference counts on first use */
+void load_bitmaps() {
+    if (bitmaps_loaded == 1) {
+        return;
+    }
+    char bitmap_buf[INODE_BITMAP_SIZE * BLOCK_SIZE];
+    read_blocks(INODE_BITMAP_LOCATION, INODE_BITMAP_SIZE, bitmap_buf);
+    memcpy(inode_bitmap, bitmap_buf, sizeof(inode_bitmap));
+    read_blocks(DATA_BLOCK_BITMAP_LOCATION, DATA_BLOCK_BITMAP_SIZE, &data_block_bitmap);
+    read_blocks(DATA_BLOCK_REFCOUNT_LOCATION, DATA_BLOCK_REFCOUNT_SIZE, &data_block_refcount);
+    bitmaps_loaded = 1;
+}
+
+void flush_inode_bitmap() {
+    if (bitmaps_loaded == 0) {
+        return;
+    }
+    char bitmap_buf[INODE_BITMAP_SIZE * BLOCK_SIZE];
+    memset(bitmap_buf, '\0', sizeof(bitmap_buf));
+    memcpy(bitmap_buf, inode_bitmap, sizeof(inode_bitmap));
+    write_blocks(INODE_BITMAP_LOCATION, INODE_BITMAP_SIZE, bitmap_buf);
+}
+
+// the data block bitmap and the reference counts always go to disk together
+void flush_data_block_bitmap() {
+    if (bitmaps_loaded == 0) {
+        return;
+    }
+    write_blocks(DATA_BLOCK_BITMAP_LOCATION, DATA_BLOCK_BITMAP_SIZE, &data_block_bitmap);
+    write_blocks(DATA_BLOCK_REFCOUNT_LOCATION, DATA_BLOCK_REFCOUNT_SIZE, &data_block_refcount);
+}
+
+/* recount the free counts of the super block from the bitmaps */
+void count_free_bits() {
+    load_bitmaps();
+    super_block.free_inodes = 0;
+    super_block.free_blocks = 0;
+    for (int i = 0; i < MAX_INODES; i++) {
+        if (inode_bitmap[i] == 0) {
+            super_block.free_inodes++;
+        }
+    }
+    for (int i = 0; i < TOTAL_NUM_OF_BLOCKS; i++) {
+        if (data_block_bitmap[i] == 0) {
+            super_block.free_blocks++;
+        }
+    }
+}
+
 // set a bit of bitmap to 1
 void set_bit_1(char* mode, int loc) {
+    load_bitmaps();
     if (strcmp(mode, "inode") == 0){
+        if (inode_bitmap[loc] == 0) {
+            super_block.free_inodes--;
+        }
         inode_bitmap[loc] = 1;
     }
     else if (strcmp(mode, "data") == 0){
+        if (data_block_bitmap[loc] == 0) {
+            super_block.free_blocks--;
+        }
         data_block_bitmap[loc] = 1;
+        data_block_refcount[loc] = 1;
     }
     else{
         fprintf(stderr, "Wrong input mode\n ");
@@ -105,11 +277,19 @@ void set_bit_1(char* mode, int loc) {
 
 // set a bit of bitmap to 0
 void set_bit_0(char* mode, int loc){
+    load_bitmaps();
     if (strcmp(mode, "inode") == 0){
+        if (inode_bitmap[loc] == 1) {
+            super_block.free_inodes++;
+        }
         inode_bitmap[loc] = 0;
     }
     else if (strcmp(mode, "data") == 0){
+        if (data_block_bitmap[loc] == 1) {
+            super_block.free_blocks++;
+        }
         data_block_bitmap[loc] = 0;
+        data_block_refcount[loc] = 0;
     }
     else{
         fprintf(stderr, "Wrong input mode\n ");
@@ -119,6 +299,7 @@ void set_bit_0(char* mode, int loc){
 
 /* bitmap -> free bit if there is a freebit, -> -1 if there is none */
 int find_free_bit(char *mode) {
+    load_bitmaps();
     if (strcmp(mode, "inode") == 0){ 
         for (int i = 0; i < MAX_INODES; i++) {
             if (inode_bitmap[i] == 0) {
@@ -126,6 +307,10 @@ int find_free_bit(char *mode) {
             }
         }
     } else if (strcmp(mode, "data") == 0){
+        // cached count tells us the disk is full without scanning
+        if (super_block.free_blocks == 0) {
+            return -1;
+        }
         for (int i = 0; i < TOTAL_NUM_OF_BLOCKS; i++) {
             if (data_block_bitmap[i] == 0) {
                 return i;
@@ -136,15 +321,187 @@ int find_free_bit(char *mode) {
     return -1;
 }
 
+/* first run of count free data blocks -> first block of the run, -1 if there is none */
+int find_free_run(int count) {
+    load_bitmaps();
+    if (super_block.free_blocks < count) {
+        return -1;
+    }
+    int run = 0;
+    for (int i = 0; i < TOTAL_NUM_OF_BLOCKS; i++) {
+        if (data_block_bitmap[i] == 0) {
+            run++;
+            if (run == count) {
+                return i - count + 1;
+            }
+        } else {
+            run = 0;
+        }
+    }
+    return -1;
+}
+
+/* reference counting for shared data blocks */
+// add a reference to an occupied data block
+void ref_block(int loc) {
+    load_bitmaps();
+    data_block_refcount[loc]++;
+}
+
+// drop a reference to a data block, erase and free it once nothing points to it anymore
+void unref_block(int loc) {
+    load_bitmaps();
+    if (data_block_refcount[loc] > 1) {
+        data_block_refcount[loc]--;
+        return;
+    }
+    char eraser[BLOCK_SIZE];
+    memset(eraser, '\0', BLOCK_SIZE);
+    write_blocks(loc, 1, eraser);
+    set_bit_0("data", loc);
+}
+
+// take a reference on every block an inode points to
+// blocks behind the indirect pointer belong to the indirect block, so only that one is counted
+void ref_inode_blocks(INODE* inode) {
+    for (int i = 0; i < 12; i++) {
+        if (inode->pointers[i] != 0) {
+            ref_block(inode->pointers[i]);
+        }
+    }
+    if (inode->indirect_pointer != 0) {
+        ref_block(inode->indirect_pointer);
+    }
+}
+
+/* copy on write */
+// copy a shared block into a new block and drop our reference to the old one
+// returns the new block, -1 if the disk is full
+int copy_on_write_block(int loc) {
+    int new_block = find_free_bit("data");
+    if (new_block == -1) {
+        fprintf(stderr, "Disk is full, cannot copy shared block. \n");
+        return -1;
+    }
+    set_bit_1("data", new_block);
+    char copy_buf[BLOCK_SIZE];
+    read_blocks(loc, 1, copy_buf);
+    write_blocks(new_block, 1, copy_buf);
+    unref_block(loc);
+    return new_block;
+}
+
+// same as above for an indirect block, the copy adds a reference to every block it points to
+int copy_on_write_indirect(int loc, int* indirect_buffer) {
+    int new_block = copy_on_write_block(loc);
+    if (new_block == -1) {
+        return -1;
+    }
+    for (int i = 0; i < (BLOCK_SIZE / sizeof(int)); i++) {
+        if (indirect_buffer[i] != 0) {
+            ref_block(indirect_buffer[i]);
+        }
+    }
+    return new_block;
+}
+
+// drop the references of every block of an inode from block index first onwards and clear those pointers
+// the indirect block is dropped too once none of its entries is kept, and the blocks
+// behind it are only released when the indirect block itself is freed
+// returns 0, -1 if a shared indirect block could not be copied
+int release_blocks_from(INODE* inode, int first) {
+    load_bitmaps();
+    for (int i = first; i < 12; i++) {
+        if (inode->pointers[i] != 0) {
+            unref_block(inode->pointers[i]);
+            inode->pointers[i] = 0;
+        }
+    }
+    if (inode->indirect_pointer == 0) {
+        return 0;
+    }
+    int indirect_buffer[BLOCK_SIZE / sizeof(int)];
+    read_blocks(inode->indirect_pointer, 1, &indirect_buffer);
+    // the indirect block only stays if one of the entries before first survives
+    int kept = 0;
+    for (int i = 0; i < first - 12; i++) {
+        if (indirect_buffer[i] != 0) {
+            kept = 1;
+        }
+    }
+    if (kept == 0) {
+        if (data_block_refcount[inode->indirect_pointer] == 1) {
+            for (int i = 0; i < (BLOCK_SIZE / sizeof(int)); i++) {
+                if (indirect_buffer[i] != 0) {
+                    unref_block(indirect_buffer[i]);
+                }
+            }
+        }
+        unref_block(inode->indirect_pointer);
+        inode->indirect_pointer = 0;
+        return 0;
+    }
+    // we keep the start of the indirect block, only drop the entries behind it
+    int in_use = 0;
+    for (int i = first - 12; i < (BLOCK_SIZE / sizeof(int)); i++) {
+        if (indirect_buffer[i] != 0) {
+            in_use = 1;
+        }
+    }
+    if (in_use == 0) {
+        return 0;
+    }
+    if (data_block_refcount[inode->indirect_pointer] > 1) {
+        int new_indirect = copy_on_write_indirect(inode->indirect_pointer, indirect_buffer);
+        if (new_indirect == -1) {
+            return -1;
+        }
+        inode->indirect_pointer = new_indirect;
+    }
+    for (int i = first - 12; i < (BLOCK_SIZE / sizeof(int)); i++) {
+        if (indirect_buffer[i] != 0) {
+            unref_block(indirect_buffer[i]);
+            indirect_buffer[i] = 0;
+        }
+    }
+    write_blocks(inode->indirect_pointer, 1, &indirect_buffer);
+    return 0;
+}
+
+// drop the references of an inode and clear its pointers
+void release_inode_blocks(INODE* inode) {
+    release_blocks_from(inode, 0);
+}
+
+/* flush the snapshot table, padded to a full block */
+void write_snapshot_table() {
+    char block_buf[BLOCK_SIZE];
+    memset(block_buf, '\0', BLOCK_SIZE);
+    memcpy(block_buf, snapshot_table, sizeof(snapshot_table));
+    write_blocks(SNAPSHOT_TABLE_LOCATION, 1, block_buf);
+}
+
 /* init fresh base blocks */
 void init_fresh_base_blocks() {
+    // everything lives in memory from the start
+    bitmaps_loaded = 1;
+    for (int i = 0; i < INODE_TABLE_SIZE; i++) {
+        inode_block_loaded[i] = 1;
+    }
+    for (int i = 0; i < DIRECTORY_TABLE_SIZE; i++) {
+        directory_block_loaded[i] = 1;
+    }
+
     // instantiate a single super block
-    SUPER_BLOCK super_block;
+    super_block.magic = MAGIC_NUMBER;
+    super_block.layout_version = LAYOUT_VERSION;
     super_block.block_size = BLOCK_SIZE;
     super_block.file_system_size = TOTAL_NUM_OF_BLOCKS * BLOCK_SIZE;
     super_block.inode_table_length = MAX_INODES;
     super_block.root_directory = ROOT_DIR_INODE_LOCATION;
-    write_blocks(SUPER_BLOCK_LOCATION, 1, &super_block);
+    super_block.clean_unmount = 0;  // in use until sfs_unmount
+    super_block.free_blocks = TOTAL_NUM_OF_BLOCKS;
+    super_block.free_inodes = MAX_INODES;
 
     // instantiate bitmap for inodes
     for (int i = 0; i < MAX_INODES; i++) {
@@ -162,9 +519,9 @@ void init_fresh_base_blocks() {
     }
     root_directory.indirect_pointer = 0;
     inode_table[0] = root_directory;
-    write_blocks(INODE_TABLE_LOCATION, INODE_TABLE_SIZE, &inode_table);
-    set_bit_1("inode", 1);  // flip bit for root directory
-    write_blocks(INODE_BITMAP_LOCATION, INODE_BITMAP_SIZE, &inode_bitmap);
+    flush_inode_table();
+    set_bit_1("inode", 0);  // flip bit for root directory
+    flush_inode_bitmap();
 
     // initialise and flip 23 blocks for data_block_bit_map since all 23 blocks are presumably occupied
     for (int i = 0; i < TOTAL_NUM_OF_BLOCKS; i++) {
@@ -173,26 +530,48 @@ void init_fresh_base_blocks() {
     for (int i = 0; i < PRE_DEFINED_BLOCKS; i++) {
         set_bit_1("data", i);
     }
-    write_blocks(DATA_BLOCK_BITMAP_LOCATION, DATA_BLOCK_BITMAP_SIZE, &data_block_bitmap);
+    flush_data_block_bitmap();
 
     // instantiate directory table;
     strcpy(directory_table[0].full_filename, "root");
     directory_table[0].inode_pointer = -1;
-    write_blocks(DIRECTORY_TABLE_LOCATION, DIRECTORY_TABLE_SIZE, &directory_table);
+    flush_directory_table();
+
+    // no snapshots yet
+    write_snapshot_table();
+    write_super_block();
 }
 
 /* init old base blocks */
-// we will load them all from disk
-void init_old_base_blocks() {
-    // inode bitmap
-    read_blocks(INODE_BITMAP_LOCATION, INODE_BITMAP_SIZE, &inode_bitmap);
-    // directory table
-    read_blocks(DIRECTORY_TABLE_LOCATION, DIRECTORY_TABLE_SIZE, &directory_table);
-    // inode table
-    read_blocks(INODE_TABLE_LOCATION, INODE_TABLE_SIZE, &inode_table);
-    // bitmap table
-    read_blocks(DATA_BLOCK_BITMAP_LOCATION, DATA_BLOCK_BITMAP_SIZE, &data_block_bitmap);
-
+// only the super block and the snapshot table are read here,
+// the other tables are loaded from disk when they are first used
+// returns 0, -1 if the disk does not hold this file system
+int init_old_base_blocks() {
+    // super block
+    char block_buf[BLOCK_SIZE];
+    read_blocks(SUPER_BLOCK_LOCATION, 1, block_buf);
+    memcpy(&super_block, block_buf, sizeof(super_block));
+    if (super_block.magic != MAGIC_NUMBER) {
+        fprintf(stderr, "Wrong magic number, not a disk of this file system. \n");
+        return -1;
+    }
+    // reference counts and snapshots sit where older layouts kept data blocks
+    if (super_block.layout_version != LAYOUT_VERSION) {
+        fprintf(stderr, "Disk layout version %d is not supported, expected %d. \n",
+                super_block.layout_version, LAYOUT_VERSION);
+        return -1;
+    }
+    // snapshot table
+    read_blocks(SNAPSHOT_TABLE_LOCATION, 1, block_buf);
+    memcpy(snapshot_table, block_buf, sizeof(snapshot_table));
+    // free counts cannot be trusted if the last session did not unmount, recount them from the bitmaps
+    if (super_block.clean_unmount != 1) {
+        count_free_bits();
+    }
+    // mark the disk as in use until sfs_unmount
+    super_block.clean_unmount = 0;
+    write_super_block();
+    return 0;
 }
 
 /* mksfs */
@@ -200,12 +579,22 @@ void init_old_base_blocks() {
 // fresh == 0 -> load from disk
 void mksfs(int fresh) {
     // before running we dump everything in the memory so there is no garbage
-    memset(data_block_bitmap, '\0', sizeof(data_block_bitmap));
-    memset(inode_bitmap, '\0', sizeof(inode_bitmap));
-    memset(inode_table, '\0', sizeof(inode_table));
-    memset(directory_table, '\0', sizeof(directory_table));
+    // the tables and bitmaps are only cleared for a fresh disk, on an old disk
+    // every block is overwritten by the lazy loaders before it is used
+    memset(snapshot_table, '\0', sizeof(snapshot_table));
+    memset(directory_cursor_table, '\0', sizeof(directory_cursor_table));
+    memset(open_file_descriptor_table, '\0', sizeof(open_file_descriptor_table));
+    memset(inode_block_loaded, '\0', sizeof(inode_block_loaded));
+    memset(directory_block_loaded, '\0', sizeof(directory_block_loaded));
+    bitmaps_loaded = 0;
+    current_directory = 1;
     // fresh flag == 1
     if (fresh == 1) {  
+        memset(data_block_bitmap, '\0', sizeof(data_block_bitmap));
+        memset(data_block_refcount, '\0', sizeof(data_block_refcount));
+        memset(inode_bitmap, '\0', sizeof(inode_bitmap));
+        memset(inode_table, '\0', sizeof(inode_table));
+        memset(directory_table, '\0', sizeof(directory_table));
         // init disk
         int ret = init_fresh_disk(DEFAULT_DISK_NAME, BLOCK_SIZE, TOTAL_NUM_OF_BLOCKS);
         if (ret == -1) {
@@ -220,17 +609,41 @@ void mksfs(int fresh) {
         if (ret == -1) {
             fprintf(stderr, "File System Recreation Failure. \n");
         }
-        init_old_base_blocks();
+        // refuse to mount a disk we do not understand rather than corrupt it
+        if (init_old_base_blocks() == -1) {
+            fprintf(stderr, "File System Recreation Failure. \n");
+            close_disk();
+            exit(0);
+        }
     }
 }
 
+/* sfs_unmount */
+// writes back everything that was loaded, records the free counts
+// and marks the disk as cleanly unmounted so the next mksfs(0) can trust them
+// all open files and directory listings are closed
+void sfs_unmount() {
+    flush_inode_table();
+    flush_directory_table();
+    flush_inode_bitmap();
+    flush_data_block_bitmap();
+    super_block.clean_unmount = 1;
+    write_super_block();
+    close_disk();
+    // descriptors and listings do not survive the unmount
+    memset(open_file_descriptor_table, '\0', sizeof(open_file_descriptor_table));
+    memset(directory_cursor_table, '\0', sizeof(directory_cursor_table));
+    current_directory = 1;
+}
+
 /* returns the name of the next file in directory into fname*/
 // works as a circular array, if there are no more next files,
 // return to the first file in directory
 int sfs_getnextfilename(char* fname) {
     while (current_directory != MAX_INODES){
-        if (directory_table[current_directory].inode_pointer != 0 && strncmp(directory_table[current_directory].full_filename, "root", MAX_FNAME_LENGTH) != 0 ) {
-            strcpy(fname, directory_table[current_directory].full_filename);
+        DIRECTORY_ENTRY* entry = get_directory_entry(current_directory);
+        if (entry->inode_pointer != 0 && strncmp(entry->full_filename, "root", MAX_FNAME_LENGTH) != 0 ) {
+            strcpy(fname, entry->full_filename);
             current_directory++;
             return 1;
         }
@@ -247,15 +660,99 @@ int sfs_getnextfilename(char* fname) {
 // get the file size referred to by the path name
 int sfs_getfilesize(const char* path) {
     for (int i = 0; i < MAX_INODES; i++) {
-        if (strncmp(path, directory_table[i].full_filename, 32) == 0) {
+        if (strncmp(path, get_directory_entry(i)->full_filename, 32) == 0) {
             int ptr = directory_table[i].inode_pointer;
-            int size = inode_table[ptr].size;
+            int size = get_inode(ptr)->size;
             return size;
         }
     }
     return 0;
 }
 
+/* sfs_opendir */
+// opens a listing of the directory with its own cursor, so several callers
+// can walk the directory at the same time without touching sfs_getnextfilename
+// returns the cursor index, -1 if all cursors are taken
+int sfs_opendir() {
+    for (int i = 0; i < MAX_DIRECTORY_CURSORS; i++) {
+        if (directory_cursor_table[i].in_use == 0) {
+            directory_cursor_table[i].in_use = 1;
+            directory_cursor_table[i].position = 1;
+            return i;
+        }
+    }
+    fprintf(stderr, "directory_cursor_table full. \n");
+    return -1;
+}
+
+// helper to count the data blocks used by an inode, including the indirect block
+int count_inode_blocks(INODE* inode) {
+    int count = 0;
+    for (int i = 0; i < 12; i++) {
+        if (inode->pointers[i] != 0) {
+            count++;
+        }
+    }
+    if (inode->indirect_pointer != 0) {
+        int indirect_buffer[BLOCK_SIZE / sizeof(int)];
+        read_blocks(inode->indirect_pointer, 1, &indirect_buffer);
+        for (int i = 0; i < (BLOCK_SIZE / sizeof(int)); i++) {
+            if (indirect_buffer[i] != 0) {
+                count++;
+            }
+        }
+        count++;
+    }
+    return count;
+}
+
+/* sfs_readdir_batch */
+// dirID: cursor returned by sfs_opendir
+// entries: array to fill with up to max_entries names and inode attributes
+// returns the number of entries filled, 0 once the end of the directory is reached, -1 on error
+int sfs_readdir_batch(int dirID, DIRECTORY_LISTING* entries, int max_entries) {
+    if (dirID < 0 || dirID >= MAX_DIRECTORY_CURSORS || directory_cursor_table[dirID].in_use == 0) {
+        fprintf(stderr, "Directory is not open. \n");
+        return -1;
+    }
+    // 0 is reserved for the end of the directory
+    if (entries == NULL || max_entries <= 0) {
+        fprintf(stderr, "No room for directory entries. \n");
+        return -1;
+    }
+    int count = 0;
+    int position = directory_cursor_table[dirID].position;
+    while (position < MAX_INODES && count < max_entries) {
+        DIRECTORY_ENTRY entry = *get_directory_entry(position);
+        position++;
+        if (entry.inode_pointer == 0 || strncmp(entry.full_filename, "root", MAX_FNAME_LENGTH) == 0) {
+            continue;
+        }
+        INODE* inode = get_inode(entry.inode_pointer);
+        strncpy(entries[count].full_filename, entry.full_filename, MAX_FNAME_LENGTH);
+        entries[count].full_filename[MAX_FNAME_LENGTH] = '\0';
+        entries[count].mode = inode->mode;
+        entries[count].size = inode->size;
+        entries[count].block_count = count_inode_blocks(inode);
+        count++;
+    }
+    directory_cursor_table[dirID].position = position;
+    return count;
+}
+
+/* sfs_closedir */
+// releases a cursor returned by sfs_opendir
+// success -> return 0, fail -> return -1
+int sfs_closedir(int dirID) {
+    if (dirID < 0 || dirID >= MAX_DIRECTORY_CURSORS || directory_cursor_table[dirID].in_use == 0) {
+        fprintf(stderr, "Directory is not open. \n");
+        return -1;
+    }
+    directory_cursor_table[dirID].in_use = 0;
+    directory_cursor_table[dirID].position = 0;
+    return 0;
+}
+
 // helper function to fine free entry in the following tables
 // 1. Open file descriptor table
 // 2. Directory table
@@ -272,7 +769,7 @@ int find_free_entry(char* mode) {
         return -1;
     } else if (strcmp("directory_table", mode) == 0) {
         for (int i = 0; i < MAX_INODES; i++) {
-            DIRECTORY_ENTRY entry = directory_table[i];
+            DIRECTORY_ENTRY entry = *get_directory_entry(i);
             if (strcmp(entry.full_filename, "") == 0) {
                 return i;
             }
@@ -281,7 +778,7 @@ int find_free_entry(char* mode) {
         return -1;
     } else if (strcmp("inode_table", mode) == 0) {
         for (int i = 1; i < MAX_INODES; i++) {
-            INODE inode = inode_table[i];
+            INODE inode = *get_inode(i);
             if (inode.mode == 0) {
                 return i;
             }
@@ -307,7 +804,7 @@ int sfs_fopen(char* name) {
     }
     // Iterate directory table
     for (int i = 1; i < MAX_INODES; i++) {
-        DIRECTORY_ENTRY entry = directory_table[i];
+        DIRECTORY_ENTRY entry = *get_directory_entry(i);
         // found the file in the directory table
         if (strncmp(entry.full_filename, name, MAX_FNAME_LENGTH) == 0) {
             int inode_index = entry.inode_pointer;
@@ -321,7 +818,7 @@ int sfs_fopen(char* name) {
                 insert_descriptor.inode_pointer = inode_index;
                 insert_descriptor.read_pointer = 0;
                 // last byte is where we should continue writing
-                insert_descriptor.write_pointer = inode_table[inode_index].size;
+                insert_descriptor.write_pointer = get_inode(inode_index)->size;
                 open_file_descriptor_table[i] = insert_descriptor;
                 return i;
             }
@@ -346,7 +843,7 @@ int sfs_fopen(char* name) {
     inode.indirect_pointer = 0;
     inode.size = 0;
     inode.uid = 0;
-    inode_table[free_inode_loc] = inode;
+    *get_inode(free_inode_loc) = inode;
     // create entry in the directory table
     strcpy(directory_table[free_dir_loc].full_filename, name);
     directory_table[free_dir_loc].inode_pointer = free_inode_loc;
@@ -357,9 +854,9 @@ int sfs_fopen(char* name) {
     // occupy a bit on the bitmap
     set_bit_1("inode", free_inode_loc);
     // write inode into disk
-    write_blocks(INODE_TABLE_LOCATION, INODE_TABLE_SIZE, &inode_table);
+    flush_inode_table();
     // write directory table into disk
-    write_blocks(DIRECTORY_TABLE_LOCATION, DIRECTORY_TABLE_SIZE, &directory_table);
+    flush_directory_table();
 
     return free_dir_loc;
 }
@@ -433,7 +930,10 @@ int sfs_fwrite(int fileID, const char* buf, int length) {
     int bytes_wrote = 0;
     int write_ptr_loc = descriptor.write_pointer;
     char* buffer = (char*)buf;
-    int indirect_pointer = inode_table[descriptor.inode_pointer].indirect_pointer;
+    int indirect_pointer = get_inode(descriptor.inode_pointer)->indirect_pointer;
+    // reference counts are checked below before writing to a block
+    load_bitmaps();
+    int allocated = 0;  // set once this call allocates or copies a block
     int indirect_buffer[BLOCK_SIZE / sizeof(int)];
 
     // if the indirect pointer is already being used, we load the datablock into buffer
@@ -457,12 +957,24 @@ int sfs_fwrite(int fileID, const char* buf, int length) {
                 block_pointer = find_free_bit("data");
                 if (block_pointer == -1) {
                     fprintf(stderr, "Disk is full, cannot write anymore. \n");
-                    return -1;
+                    bytes_wrote = -1;
+                    break;
                 }
                 set_bit_1("data", block_pointer);
+                allocated = 1;
                 // add to the inodes
                 inode_table[inode].pointers[block_pointer_index] = block_pointer;
             }
+            // block is shared with a clone or a snapshot, write to a private copy instead
+            else if (data_block_refcount[block_pointer] > 1) {
+                block_pointer = copy_on_write_block(block_pointer);
+                if (block_pointer == -1) {
+                    bytes_wrote = -1;
+                    break;
+                }
+                allocated = 1;
+                inode_table[inode].pointers[block_pointer_index] = block_pointer;
+            }
             // write to block
             int bytes = write_to_block(block_pointer, buffer, remaining, offset);
             // add bytes
@@ -481,14 +993,23 @@ int sfs_fwrite(int fileID, const char* buf, int length) {
             // set up
             int block_pointer;
             int offset;
+            // find which block we want to operate on
+            int block_index = ((write_ptr_loc / BLOCK_SIZE) - 12);
+            if (block_index >= (BLOCK_SIZE / sizeof(int))) {
+                fprintf(stderr, "Error: Maximum file size reached.\n");
+                bytes_wrote = -1;
+                break;
+            }
             // there is no indirect pointer present, so we have to set up indirect pointer
             if (indirect_pointer == 0) {
                 int new_indirect = find_free_bit("data");
                 if (new_indirect == -1) {
                     fprintf(stderr,"Disk is full. \n");
-                    return -1;
+                    bytes_wrote = -1;
+                    break;
                 }
                 set_bit_1("data", new_indirect);
+                allocated = 1;
                 inode_table[descriptor.inode_pointer].indirect_pointer = new_indirect;
                 indirect_pointer = new_indirect;  // didnt write the pointer to the indirect block
 
@@ -496,24 +1017,29 @@ int sfs_fwrite(int fileID, const char* buf, int length) {
                 block_pointer = find_free_bit("data");
                 if (block_pointer == -1) {
                     fprintf(stderr, "Disk if full. \n");
-                    return -1;
+                    bytes_wrote = -1;
+                    break;
                 }
                 set_bit_1("data", block_pointer);
+                allocated = 1;
 
                 // initialise the indirect buffer
                 for (int i = 0; i < (BLOCK_SIZE / sizeof(int)); i++) {
                     indirect_buffer[i] = 0;
                 }
-                indirect_buffer[0] = block_pointer;
+                indirect_buffer[block_index] = block_pointer;
             } 
             // there exist an indirect pointer already we will just keep writing to it
-            else {            
-
-                // find which block we want to operate on
-                int block_index = ((write_ptr_loc / BLOCK_SIZE) - 12);
-                if (block_index > (BLOCK_SIZE / sizeof(int))) {
-                    fprintf(stderr, "Error: Maximum file size reached.\n");
-                    return -1;
+            else {
+                // indirect block is shared with a clone or a snapshot, take a private copy before changing it
+                if (data_block_refcount[indirect_pointer] > 1) {
+                    indirect_pointer = copy_on_write_indirect(indirect_pointer, indirect_buffer);
+                    if (indirect_pointer == -1) {
+                        bytes_wrote = -1;
+                        break;
+                    }
+                    allocated = 1;
+                    inode_table[descriptor.inode_pointer].indirect_pointer = indirect_pointer;
                 }
                 block_pointer = indirect_buffer[block_index];
 
@@ -522,17 +1048,25 @@ int sfs_fwrite(int fileID, const char* buf, int length) {
                     block_pointer = find_free_bit("data");
                     if (block_pointer == -1) {
                         fprintf(stderr, "Disk if full. cannot write anymore\n");
-                        return -1;
+                        bytes_wrote = -1;
+                        break;
                     }
                     set_bit_1("data", block_pointer);
+                    allocated = 1;
 
-                    // insert new block pointer in the indirect buffer
-                    for (int i = 0; i < (BLOCK_SIZE / sizeof(int)); i++) {
-                        if (indirect_buffer[i] == 0) {
-                            indirect_buffer[i] = block_pointer;
-                            break;
-                        }
+                    // insert new block pointer in the indirect buffer,
+                    // entries before it may be holes left by sfs_fseek or sfs_ftruncate
+                    indirect_buffer[block_index] = block_pointer;
+                }
+                // block is shared with a clone or a snapshot, write to a private copy instead
+                else if (data_block_refcount[block_pointer] > 1) {
+                    block_pointer = copy_on_write_block(block_pointer);
+                    if (block_pointer == -1) {
+                        bytes_wrote = -1;
+                        break;
                     }
+                    allocated = 1;
+                    indirect_buffer[block_index] = block_pointer;
                 }
             }
 
@@ -552,15 +1086,17 @@ int sfs_fwrite(int fileID, const char* buf, int length) {
         }
         // update open file descriptor table
         open_file_descriptor_table[fileID].write_pointer = write_ptr_loc;
-        // and we are done, now flush all to memory
-        write_blocks(DATA_BLOCK_BITMAP_LOCATION, DATA_BLOCK_BITMAP_SIZE, &data_block_bitmap);
-        // if we used indirect_pointer, write to disk
-        if (indirect_pointer != 0) {
+    }
+    // and we are done, now flush all to memory once
+    // the indirect block, bitmap and reference counts only change when a block was allocated or copied
+    if (allocated == 1) {
+        if (indirect_pointer > 0) {
             write_blocks(indirect_pointer, 1, &indirect_buffer);
         }
-        // we updated inodes
-        write_blocks(INODE_TABLE_LOCATION, INODE_TABLE_SIZE, &inode_table);
+        flush_data_block_bitmap();
     }
+    // we updated inodes
+    flush_inode_table();
     return bytes_wrote;
 }
 
@@ -570,6 +1106,13 @@ int sfs_fwrite(int fileID, const char* buf, int length) {
 // length: number of bytes remaining to read
 // offset: offset in the datablock to start reading from
 int read_from_block(int block_pointer, char* buffer, int length, int offset) {
+    // block 0 is the super block, a pointer to it means the block was never written
+    if (block_pointer == 0) {
+        int max_read = min(BLOCK_SIZE - offset, length);
+        memset(buffer, '\0', max_read);
+        return max_read;
+    }
+
     // adjust read location for offsets
     char* string_buf= malloc(BLOCK_SIZE);
     memset(string_buf, '\0', BLOCK_SIZE);
@@ -607,7 +1150,7 @@ int sfs_fread(int fileID, char* buf, int length) {
     
     // if we are reading past the total size of the file
     // read till the end of the file only
-    if (length+read_ptr_loc > inode_table[descriptor.inode_pointer].size) {
+    if (length+read_ptr_loc > get_inode(descriptor.inode_pointer)->size) {
         remaining = inode_table[descriptor.inode_pointer].size - descriptor.read_pointer;
     }
     int bytes_read = 0;
@@ -642,10 +1185,9 @@ int sfs_fread(int fileID, char* buf, int length) {
             // set up indirect pointer things
             int block_pointer;
             int offset;
-            // there is no indirect pointer, corrupted file system
+            // there is no indirect pointer, the rest of the file is a hole left by sfs_ftruncate
             if (indirect_pointer == 0) {
-                fprintf(stderr, "NOOOOO, corrupted file system, nothing to read in indirect pointers\n");
-                return -1;
+                block_pointer = 0;
             } else {
                 // find which block we want to operate on
                 int block_index = ((read_ptr_loc / BLOCK_SIZE) - 12);
@@ -682,13 +1224,154 @@ int sfs_fseek(int fileID, int loc) {
     return 1;
 }
 
+/* sfs_fallocate */
+// reserves the blocks covering bytes [offset, offset + length) of a file up front,
+// so later writes to that range do not have to allocate
+// the file size is not changed, blocks past the end of the file stay unwritten until sfs_fwrite reaches them
+// success -> return 0, fail -> return -1
+int sfs_fallocate(int fileID, int offset, int length) {
+    if (fileID < 0 || fileID >= MAX_INODES || open_file_descriptor_table[fileID].inode_pointer == 0) {
+        fprintf(stderr, "File is not open. \n");
+        return -1;
+    }
+    if (offset < 0 || length <= 0 || offset + length > MAX_FILE_BLOCKS * BLOCK_SIZE) {
+        fprintf(stderr, "Error: Maximum file size reached.\n");
+        return -1;
+    }
+    INODE* inode = get_inode(open_file_descriptor_table[fileID].inode_pointer);
+    int first = offset / BLOCK_SIZE;
+    int last = (offset + length - 1) / BLOCK_SIZE;
+    int indirect_buffer[BLOCK_SIZE / sizeof(int)];
+    memset(indirect_buffer, '\0', sizeof(indirect_buffer));
+    load_bitmaps();
+
+    if (last >= 12 && inode->indirect_pointer != 0) {
+        read_blocks(inode->indirect_pointer, 1, &indirect_buffer);
+    }
+
+    // count the blocks we are missing, and how many of them go into the indirect block
+    int needed = 0;
+    int indirect_needed = 0;
+    for (int b = first; b <= last; b++) {
+        int block_pointer = b < 12 ? inode->pointers[b] : indirect_buffer[b - 12];
+        if (block_pointer == 0) {
+            needed++;
+            if (b >= 12) {
+                indirect_needed++;
+            }
+        }
+    }
+    if (needed == 0) {
+        return 0;
+    }
+    int need_indirect = (last >= 12 && inode->indirect_pointer == 0);
+    // a shared indirect block only has to be copied if one of its slots changes
+    int need_copy = (indirect_needed > 0 && inode->indirect_pointer != 0 &&
+                     data_block_refcount[inode->indirect_pointer] > 1);
+    if (super_block.free_blocks < needed + need_indirect + need_copy) {
+        fprintf(stderr, "Disk is full, cannot preallocate. \n");
+        return -1;
+    }
+
+    // indirect block is shared with a clone or a snapshot, take a private copy before changing it
+    if (need_copy) {
+        int new_indirect = copy_on_write_indirect(inode->indirect_pointer, indirect_buffer);
+        if (new_indirect == -1) {
+            return -1;
+        }
+        inode->indirect_pointer = new_indirect;
+    }
+
+    // take one contiguous run if there is one, otherwise fall back to the lowest free blocks
+    // the indirect block goes at the end of the run so the data blocks stay next to each other
+    int next = find_free_run(needed + need_indirect);
+    for (int b = first; b <= last; b++) {
+        int* slot = b < 12 ? &inode->pointers[b] : &indirect_buffer[b - 12];
+        if (*slot == 0) {
+            int block_pointer = next != -1 ? next++ : find_free_bit("data");
+            set_bit_1("data", block_pointer);
+            *slot = block_pointer;
+        }
+    }
+    if (need_indirect) {
+        int block_pointer = next != -1 ? next : find_free_bit("data");
+        set_bit_1("data", block_pointer);
+        inode->indirect_pointer = block_pointer;
+    }
+
+    // overwrite all blocks
+    if (indirect_needed > 0) {
+        write_blocks(inode->indirect_pointer, 1, &indirect_buffer);
+    }
+    flush_data_block_bitmap();
+    flush_inode_table();
+    return 0;
+}
+
+/* sfs_ftruncate */
+// sets the size of a file to length
+// every block past the new end is freed, including the indirect block once it is empty
+// and blocks reserved by sfs_fallocate, growing leaves a hole that reads back as 0s
+// read and write pointers past the new end are moved back to it
+// success -> return 0, fail -> return -1
+int sfs_ftruncate(int fileID, int length) {
+    if (fileID < 0 || fileID >= MAX_INODES || open_file_descriptor_table[fileID].inode_pointer == 0) {
+        fprintf(stderr, "File is not open. \n");
+        return -1;
+    }
+    if (length < 0 || length > MAX_FILE_BLOCKS * BLOCK_SIZE) {
+        fprintf(stderr, "Error: Maximum file size reached.\n");
+        return -1;
+    }
+    OPEN_FILE_DESCRIPTOR descriptor = open_file_descriptor_table[fileID];
+    INODE* inode = get_inode(descriptor.inode_pointer);
+
+    if (length < inode->size) {
+        // clear the rest of the last block we keep, so growing the file later does not bring old data back
+        // a hole already reads as 0s, so only a block that exists is cleared
+        int tail = min(BLOCK_SIZE - length % BLOCK_SIZE, inode->size - length);
+        int tail_block = length / BLOCK_SIZE;
+        int tail_pointer = 0;
+        if (tail_block < 12) {
+            tail_pointer = inode->pointers[tail_block];
+        } else if (inode->indirect_pointer != 0) {
+            int indirect_buffer[BLOCK_SIZE / sizeof(int)];
+            read_blocks(inode->indirect_pointer, 1, &indirect_buffer);
+            tail_pointer = indirect_buffer[tail_block - 12];
+        }
+        if (length % BLOCK_SIZE != 0 && tail_pointer != 0) {
+            char zeros[BLOCK_SIZE];
+            memset(zeros, '\0', BLOCK_SIZE);
+            open_file_descriptor_table[fileID].write_pointer = length;
+            int bytes = sfs_fwrite(fileID, zeros, tail);
+            open_file_descriptor_table[fileID].write_pointer = descriptor.write_pointer;
+            if (bytes == -1) {
+                return -1;
+            }
+        }
+    }
+    // free everything after the last block we keep, including blocks sfs_fallocate reserved past the end
+    int keep = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (release_blocks_from(inode, keep) == -1) {
+        return -1;
+    }
+    inode->size = length;
+    open_file_descriptor_table[fileID].read_pointer = min(open_file_descriptor_table[fileID].read_pointer, length);
+    open_file_descriptor_table[fileID].write_pointer = min(open_file_descriptor_table[fileID].write_pointer, length);
+
+    // overwrite all blocks
+    flush_data_block_bitmap();
+    flush_inode_table();
+    return 0;
+}
+
 /* removes a file */
 // file: file name to remove
 int sfs_remove(char* file) {
     // remove from directories
     int index = 0;
     for (int i = 0; i < MAX_INODES; i++) {
-        if (strncmp(directory_table[i].full_filename, file, MAX_FNAME_LENGTH) == 0) {
+        if (strncmp(get_directory_entry(i)->full_filename, file, MAX_FNAME_LENGTH) == 0) {
             index = i;
             break;
         }
@@ -711,44 +1394,491 @@ int sfs_remove(char* file) {
         open_file_descriptor_table[index].write_pointer = 0;
     }
     // remove inode block
-    inode_table[inode_ptr].gid = 0;
+    get_inode(inode_ptr)->gid = 0;
 
-    // fill a block with 0s so we can erase data
-    int eraser[BLOCK_SIZE];
-    memset(&eraser, '\0', sizeof(eraser));
+    // release data blocks, blocks still shared with clones or snapshots are kept
+    release_inode_blocks(&inode_table[inode_ptr]);
+    inode_table[inode_ptr].link_cnt = 0;
+    inode_table[inode_ptr].mode = 0;
+    inode_table[inode_ptr].uid = 0;
+    set_bit_0("inode", inode_ptr);
 
-    // resolve indirect pointer data blocks
-    int indirect_pointer = inode_table[inode_ptr].indirect_pointer;
-    if (indirect_pointer != 0) {
-        int indirect_buffer[BLOCK_SIZE / sizeof(int)];
-        read_blocks(indirect_pointer, 1, &indirect_buffer);
+    // overwrite all blocks
+    flush_inode_bitmap();
+    flush_data_block_bitmap();
+    flush_inode_table();
+    flush_directory_table();
+    return 0;
+}
 
-        for (int i = 0; i < (BLOCK_SIZE / sizeof(int)); i++) {
-            if (indirect_buffer[i] != 0) {
-                write_blocks(indirect_buffer[i], 1, &eraser);
-                set_bit_0("data", indirect_buffer[i]);
-            }
+/* sfs_clone */
+// creates dst as a copy of src that shares all of src's data blocks,
+// a block is only copied once one of the two files writes to it
+int sfs_clone(char* src, char* dst) {
+    if (strlen(dst) > MAX_FNAME_LENGTH) {
+        fprintf(stderr, "File name is too long\n");
+        return -1;
+    }
+    int src_inode = 0;
+    for (int i = 1; i < MAX_INODES; i++) {
+        if (strncmp(get_directory_entry(i)->full_filename, dst, MAX_FNAME_LENGTH) == 0) {
+            fprintf(stderr, "File already exists in directories table. \n");
+            return -1;
+        }
+        if (strncmp(directory_table[i].full_filename, src, MAX_FNAME_LENGTH) == 0) {
+            src_inode = directory_table[i].inode_pointer;
         }
-        set_bit_0("data", indirect_pointer);
     }
-    inode_table[inode_ptr].indirect_pointer = 0;
-    inode_table[inode_ptr].link_cnt = 0;
-    inode_table[inode_ptr].mode = 0;
+    if (src_inode == 0) {
+        fprintf(stderr, "File does not exist in directories table. \n");
+        return -1;
+    }
+    int free_dir_loc = find_free_entry("directory_table");
+    int free_inode_loc = find_free_entry("inode_table");
+    if (free_dir_loc == -1 || free_inode_loc == -1) {
+        return -1;
+    }
+    // copy the inode and share its blocks
+    *get_inode(free_inode_loc) = *get_inode(src_inode);
+    ref_inode_blocks(&inode_table[free_inode_loc]);
+    strcpy(directory_table[free_dir_loc].full_filename, dst);
+    directory_table[free_dir_loc].inode_pointer = free_inode_loc;
+    set_bit_1("inode", free_inode_loc);
 
-    // resolve direct pointers
-    for (int i = 0; i < 12; i++) {
-        if (inode_table[inode_ptr].pointers[i] != 0) {
-            write_blocks(inode_table[inode_ptr].pointers[i], 1, &eraser);
-            set_bit_0("data", inode_table[inode_ptr].pointers[i]);
-            inode_table[inode_ptr].pointers[i] = 0;
+    // overwrite all blocks
+    flush_inode_bitmap();
+    flush_data_block_bitmap();
+    flush_inode_table();
+    flush_directory_table();
+    return 0;
+}
+
+/* snapshots */
+// a snapshot is a saved copy of the inode and directory tables, every file in it
+// keeps a reference on its data blocks so they survive changes to the live files
+
+// helper to find a snapshot by name, -1 if there is none
+int find_snapshot(char* name) {
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (snapshot_table[i].in_use == 1 && strncmp(snapshot_table[i].name, name, MAX_FNAME_LENGTH) == 0) {
+            return i;
         }
     }
-    inode_table[inode_ptr].uid = 0;
-    set_bit_0("inode", inode_ptr);
+    return -1;
+}
+
+// helper to load the tables of a snapshot into the given arrays
+void read_snapshot(int index, INODE* inodes, DIRECTORY_ENTRY* directories) {
+    int location = SNAPSHOT_DATA_LOCATION + index * SNAPSHOT_SIZE;
+    char directory_buf[DIRECTORY_TABLE_SIZE * BLOCK_SIZE];
+    read_blocks(location, INODE_TABLE_SIZE, inodes);
+    read_blocks(location + INODE_TABLE_SIZE, DIRECTORY_TABLE_SIZE, directory_buf);
+    memcpy(directories, directory_buf, sizeof(directory_table));
+}
+
+/* sfs_snapshot_create */
+// saves the current inode and directory tables under name
+// success -> return 0, fail -> return -1
+int sfs_snapshot_create(char* name) {
+    if (strlen(name) > MAX_FNAME_LENGTH) {
+        fprintf(stderr, "Snapshot name is too long\n");
+        return -1;
+    }
+    if (find_snapshot(name) != -1) {
+        fprintf(stderr, "Snapshot already exists. \n");
+        return -1;
+    }
+    int index = -1;
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (snapshot_table[i].in_use == 0) {
+            index = i;
+            break;
+        }
+    }
+    if (index == -1) {
+        fprintf(stderr, "snapshot_table full. \n");
+        return -1;
+    }
+    // the snapshot holds its own reference on every block in use
+    load_all_tables();
+    for (int i = 1; i < MAX_INODES; i++) {
+        if (inode_table[i].mode != 0) {
+            ref_inode_blocks(&inode_table[i]);
+        }
+    }
+    int location = SNAPSHOT_DATA_LOCATION + index * SNAPSHOT_SIZE;
+    char directory_buf[DIRECTORY_TABLE_SIZE * BLOCK_SIZE];
+    memset(directory_buf, '\0', sizeof(directory_buf));
+    memcpy(directory_buf, directory_table, sizeof(directory_table));
+    write_blocks(location, INODE_TABLE_SIZE, &inode_table);
+    write_blocks(location + INODE_TABLE_SIZE, DIRECTORY_TABLE_SIZE, directory_buf);
+
+    strncpy(snapshot_table[index].name, name, MAX_FNAME_LENGTH);
+    snapshot_table[index].in_use = 1;
+    write_snapshot_table();
+    flush_data_block_bitmap();
+    return 0;
+}
+
+/* sfs_snapshot_delete */
+// drops a snapshot and frees the blocks only it was still using
+// success -> return 0, fail -> return -1
+int sfs_snapshot_delete(char* name) {
+    int index = find_snapshot(name);
+    if (index == -1) {
+        fprintf(stderr, "Snapshot does not exist. \n");
+        return -1;
+    }
+    INODE snapshot_inodes[MAX_INODES];
+    DIRECTORY_ENTRY snapshot_directories[MAX_INODES];
+    read_snapshot(index, snapshot_inodes, snapshot_directories);
+    for (int i = 1; i < MAX_INODES; i++) {
+        if (snapshot_inodes[i].mode != 0) {
+            release_inode_blocks(&snapshot_inodes[i]);
+        }
+    }
+    memset(&snapshot_table[index], '\0', sizeof(SNAPSHOT_ENTRY));
 
     // overwrite all blocks
-    write_blocks(INODE_BITMAP_LOCATION, INODE_BITMAP_SIZE, &inode_bitmap);
-    write_blocks(DATA_BLOCK_BITMAP_LOCATION, DATA_BLOCK_BITMAP_SIZE, &data_block_bitmap);
-    write_blocks(DIRECTORY_TABLE_LOCATION, DIRECTORY_TABLE_SIZE, &directory_table);
+    write_snapshot_table();
+    flush_data_block_bitmap();
     return 0;
 }
+
+/* sfs_snapshot_restore */
+// rolls the live file system back to a snapshot, the snapshot itself is kept
+// all open files are closed since their inodes may no longer exist
+// success -> return 0, fail -> return -1
+int sfs_snapshot_restore(char* name) {
+    int index = find_snapshot(name);
+    if (index == -1) {
+        fprintf(stderr, "Snapshot does not exist. \n");
+        return -1;
+    }
+    INODE snapshot_inodes[MAX_INODES];
+    DIRECTORY_ENTRY snapshot_directories[MAX_INODES];
+    read_snapshot(index, snapshot_inodes, snapshot_directories);
+    load_all_tables();
+    load_bitmaps();
+
+    // take the snapshot's references before dropping the live ones,
+    // so blocks shared by both are never freed on the way
+    for (int i = 1; i < MAX_INODES; i++) {
+        if (snapshot_inodes[i].mode != 0) {
+            ref_inode_blocks(&snapshot_inodes[i]);
+        }
+    }
+    for (int i = 1; i < MAX_INODES; i++) {
+        if (inode_table[i].mode != 0) {
+            release_inode_blocks(&inode_table[i]);
+        }
+    }
+    memcpy(inode_table, snapshot_inodes, sizeof(inode_table));
+    memcpy(directory_table, snapshot_directories, sizeof(directory_table));
+    for (int i = 1; i < MAX_INODES; i++) {
+        inode_bitmap[i] = inode_table[i].mode != 0;
+    }
+    // the bitmap was rebuilt directly, so the cached free counts have to be recounted
+    count_free_bits();
+    memset(open_file_descriptor_table, '\0', sizeof(open_file_descriptor_table));
+    current_directory = 1;
+
+    // overwrite all blocks
+    flush_inode_bitmap();
+    flush_data_block_bitmap();
+    flush_inode_table();
+    flush_directory_table();
+    return 0;
+}
+
+/* helper for sfs_fsck */
+// counts the references of one inode into expected, the blocks behind an indirect block
+// are only counted the first time that indirect block is seen
+// pointers outside of the data area are reported, and cleared when repairing
+// returns the number of problems found
+int fsck_inode_blocks(INODE* inode, int* expected, int* seen_indirect, int repair) {
+    int problems = 0;
+    for (int i = 0; i < 12; i++) {
+        int ptr = inode->pointers[i];
+        if (ptr == 0) {
+            continue;
+        }
+        if (ptr < PRE_DEFINED_BLOCKS || ptr >= TOTAL_NUM_OF_BLOCKS) {
+            fprintf(stderr, "fsck: inode points at invalid block %d. \n", ptr);
+            problems++;
+            if (repair == 1) {
+                inode->pointers[i] = 0;
+            }
+            continue;
+        }
+        expected[ptr]++;
+    }
+    int indirect_pointer = inode->indirect_pointer;
+    if (indirect_pointer == 0) {
+        return problems;
+    }
+    if (indirect_pointer < PRE_DEFINED_BLOCKS || indirect_pointer >= TOTAL_NUM_OF_BLOCKS) {
+        fprintf(stderr, "fsck: inode points at invalid indirect block %d. \n", indirect_pointer);
+        problems++;
+        if (repair == 1) {
+            inode->indirect_pointer = 0;
+        }
+        return problems;
+    }
+    expected[indirect_pointer]++;
+    if (seen_indirect[indirect_pointer] == 1) {
+        return problems;
+    }
+    seen_indirect[indirect_pointer] = 1;
+
+    int indirect_buffer[BLOCK_SIZE / sizeof(int)];
+    int changed = 0;
+    read_blocks(indirect_pointer, 1, &indirect_buffer);
+    for (int i = 0; i < (BLOCK_SIZE / sizeof(int)); i++) {
+        int ptr = indirect_buffer[i];
+        if (ptr == 0) {
+            continue;
+        }
+        if (ptr < PRE_DEFINED_BLOCKS || ptr >= TOTAL_NUM_OF_BLOCKS) {
+            fprintf(stderr, "fsck: indirect block %d points at invalid block %d. \n", indirect_pointer, ptr);
+            problems++;
+            if (repair == 1) {
+                indirect_buffer[i] = 0;
+                changed = 1;
+            }
+            continue;
+        }
+        expected[ptr]++;
+    }
+    if (changed == 1) {
+        write_blocks(indirect_pointer, 1, &indirect_buffer);
+    }
+    return problems;
+}
+
+/* helper for sfs_fsck */
+// checks that every entry of a directory table points at its own live inode of the
+// matching inode table, and that every live inode has an entry
+// orphaned inodes are cleared when repairing, their blocks are freed by the bitmap check
+// returns the number of problems found
+int fsck_directory(DIRECTORY_ENTRY* directories, INODE* inodes, int repair) {
+    int problems = 0;
+    int inode_used[MAX_INODES];
+    memset(inode_used, '\0', sizeof(inode_used));
+    for (int i = 1; i < MAX_INODES; i++) {
+        DIRECTORY_ENTRY* entry = &directories[i];
+        int ptr = entry->inode_pointer;
+        if (strcmp(entry->full_filename, "") == 0) {
+            if (ptr != 0) {
+                fprintf(stderr, "fsck: empty directory entry %d points at inode %d. \n", i, ptr);
+                problems++;
+                if (repair == 1) {
+                    entry->inode_pointer = 0;
+                }
+            }
+            continue;
+        }
+        if (ptr <= 0 || ptr >= MAX_INODES || inodes[ptr].mode == 0 || inode_used[ptr] == 1) {
+            fprintf(stderr, "fsck: directory entry %.32s points at invalid inode %d. \n", entry->full_filename, ptr);
+            problems++;
+            if (repair == 1) {
+                strcpy(entry->full_filename, "");
+                entry->inode_pointer = 0;
+            }
+            continue;
+        }
+        inode_used[ptr] = 1;
+    }
+    for (int i = 1; i < MAX_INODES; i++) {
+        if (inodes[i].mode != 0 && inode_used[i] == 0) {
+            fprintf(stderr, "fsck: inode %d is not in the directory table. \n", i);
+            problems++;
+            if (repair == 1) {
+                memset(&inodes[i], '\0', sizeof(INODE));
+            }
+        }
+    }
+    return problems;
+}
+
+/* sfs_fsck */
+// offline consistency check, run right after mksfs(0) before any file is opened
+// 1. every directory entry points at its own live inode
+// 2. every live inode has a directory entry
+// 1. and 2. are checked for the live tables and for the tables of every snapshot
+// 3. every block pointer, in the live tables and in snapshots, points into the data area
+// 4. the bitmaps and reference counts match the blocks actually pointed at
+// repair == 1 -> fix what is found, repair == 0 -> only report
+// returns the number of problems found
+int sfs_fsck(int repair) {
+    load_all_tables();
+    load_bitmaps();
+    int problems = 0;
+
+    // 1. and 2. live directory and inode tables
+    problems += fsck_directory(directory_table, inode_table, repair);
+
+    // 3. block pointers, counting the references we find
+    int expected[TOTAL_NUM_OF_BLOCKS];
+    int seen_indirect[TOTAL_NUM_OF_BLOCKS];
+    memset(expected, '\0', sizeof(expected));
+    memset(seen_indirect, '\0', sizeof(seen_indirect));
+    for (int i = 0; i < PRE_DEFINED_BLOCKS; i++) {
+        expected[i] = 1;
+    }
+    for (int i = 1; i < MAX_INODES; i++) {
+        if (inode_table[i].mode != 0) {
+            problems += fsck_inode_blocks(&inode_table[i], expected, seen_indirect, repair);
+        }
+    }
+    for (int s = 0; s < MAX_SNAPSHOTS; s++) {
+        if (snapshot_table[s].in_use == 0) {
+            continue;
+        }
+        INODE snapshot_inodes[MAX_INODES];
+        DIRECTORY_ENTRY snapshot_directories[MAX_INODES];
+        read_snapshot(s, snapshot_inodes, snapshot_directories);
+        int snapshot_problems = fsck_directory(snapshot_directories, snapshot_inodes, repair);
+        for (int i = 1; i < MAX_INODES; i++) {
+            if (snapshot_inodes[i].mode != 0) {
+                snapshot_problems += fsck_inode_blocks(&snapshot_inodes[i], expected, seen_indirect, repair);
+            }
+        }
+        if (snapshot_problems != 0 && repair == 1) {
+            char directory_buf[DIRECTORY_TABLE_SIZE * BLOCK_SIZE];
+            memset(directory_buf, '\0', sizeof(directory_buf));
+            memcpy(directory_buf, snapshot_directories, sizeof(directory_table));
+            write_blocks(SNAPSHOT_DATA_LOCATION + s * SNAPSHOT_SIZE, INODE_TABLE_SIZE, snapshot_inodes);
+            write_blocks(SNAPSHOT_DATA_LOCATION + s * SNAPSHOT_SIZE + INODE_TABLE_SIZE, DIRECTORY_TABLE_SIZE, directory_buf);
+        }
+        problems += snapshot_problems;
+    }
+
+    // 4. data block bitmap and reference counts
+    for (int b = 0; b < TOTAL_NUM_OF_BLOCKS; b++) {
+        int used = expected[b] > 0;
+        if (data_block_bitmap[b] == used && data_block_refcount[b] == expected[b]) {
+            continue;
+        }
+        if (used == 0 && data_block_bitmap[b] == 1) {
+            fprintf(stderr, "fsck: block %d is marked in use but nothing points at it. \n", b);
+        } else if (used == 0) {
+            fprintf(stderr, "fsck: block %d is free but has reference count %d. \n", b, data_block_refcount[b]);
+        } else if (data_block_bitmap[b] == 0) {
+            fprintf(stderr, "fsck: block %d is in use but marked free. \n", b);
+        } else {
+            fprintf(stderr, "fsck: block %d has reference count %d, expected %d. \n", b, data_block_refcount[b], expected[b]);
+        }
+        problems++;
+        if (repair == 1) {
+            // free blocks are kept zeroed
+            if (used == 0) {
+                char eraser[BLOCK_SIZE];
+                memset(eraser, '\0', BLOCK_SIZE);
+                write_blocks(b, 1, eraser);
+            }
+            data_block_bitmap[b] = used;
+            data_block_refcount[b] = expected[b];
+        }
+    }
+    // inode bitmap, bit 0 is the root directory
+    for (int i = 0; i < MAX_INODES; i++) {
+        int used = (i == 0 || inode_table[i].mode != 0);
+        if (inode_bitmap[i] != used) {
+            fprintf(stderr, "fsck: inode %d is marked %s in the inode bitmap. \n", i, used ? "free" : "in use");
+            problems++;
+            if (repair == 1) {
+                inode_bitmap[i] = used;
+            }
+        }
+    }
+
+    if (repair == 1 && problems != 0) {
+        count_free_bits();
+        memset(open_file_descriptor_table, '\0', sizeof(open_file_descriptor_table));
+        flush_inode_bitmap();
+        flush_data_block_bitmap();
+        flush_inode_table();
+        flush_directory_table();
+    }
+    return problems;
+}
+
+/* sfs_defragment */
+// moves the blocks of every fragmented file into one contiguous run, in file order,
+// and rewrites its pointers so sequential reads touch neighbouring blocks
+// files sharing blocks with a clone or a snapshot are left alone, the other owners still point at the old blocks
+// files can stay open, descriptors only refer to inodes
+// returns the number of files moved
+int sfs_defragment() {
+    load_all_tables();
+    load_bitmaps();
+    int moved = 0;
+    for (int i = 1; i < MAX_INODES; i++) {
+        INODE* inode = &inode_table[i];
+        if (inode->mode == 0) {
+            continue;
+        }
+        int indirect_buffer[BLOCK_SIZE / sizeof(int)];
+        memset(indirect_buffer, '\0', sizeof(indirect_buffer));
+        int shared = 0;
+        if (inode->indirect_pointer != 0) {
+            read_blocks(inode->indirect_pointer, 1, &indirect_buffer);
+            shared = data_block_refcount[inode->indirect_pointer] > 1;
+        }
+
+        // list the blocks of the file in file order, skipping holes
+        int* slots[MAX_FILE_BLOCKS];
+        int count = 0;
+        for (int b = 0; b < MAX_FILE_BLOCKS; b++) {
+            int* slot = b < 12 ? &inode->pointers[b] : &indirect_buffer[b - 12];
+            if (*slot == 0) {
+                continue;
+            }
+            if (data_block_refcount[*slot] > 1) {
+                shared = 1;
+            }
+            slots[count] = slot;
+            count++;
+        }
+        if (count < 2 || shared == 1) {
+            continue;
+        }
+        int fragmented = 0;
+        for (int j = 1; j < count; j++) {
+            if (*slots[j] != *slots[j - 1] + 1) {
+                fragmented = 1;
+            }
+        }
+        if (fragmented == 0) {
+            continue;
+        }
+        // no run long enough, try the next file
+        int run = find_free_run(count);
+        if (run == -1) {
+            continue;
+        }
+
+        // copy the whole file into the run with a single write
+        char* run_buf = malloc(count * BLOCK_SIZE);
+        for (int j = 0; j < count; j++) {
+            read_blocks(*slots[j], 1, run_buf + j * BLOCK_SIZE);
+        }
+        write_blocks(run, count, run_buf);
+        free(run_buf);
+        for (int j = 0; j < count; j++) {
+            set_bit_1("data", run + j);
+            unref_block(*slots[j]);
+            *slots[j] = run + j;
+        }
+        if (inode->indirect_pointer != 0) {
+            write_blocks(inode->indirect_pointer, 1, &indirect_buffer);
+        }
+        moved++;
+    }
+
+    // overwrite all blocks
+    flush_data_block_bitmap();
+    flush_inode_table();
+    return moved;
+}
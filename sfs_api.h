@@ -0,0 +1,44 @@
+#ifndef SFS_API_H
+#define SFS_API_H
+
+#define MAX_FNAME_LENGTH 32  // filename length, limit to 32 for the testers
+
+// one entry returned by sfs_readdir_batch, file name plus its inode attributes
+typedef struct directory_listing {
+    char full_filename[MAX_FNAME_LENGTH + 1];
+    int mode;
+    int size;
+    int block_count;  // data blocks in use, including the indirect block
+} DIRECTORY_LISTING;
+
+void mksfs(int fresh);
+void sfs_unmount();
+int sfs_getnextfilename(char* fname);
+int sfs_getfilesize(const char* path);
+int sfs_fopen(char* name);
+int sfs_fclose(int fileID);
+int sfs_fwrite(int fileID, const char* buf, int length);
+int sfs_fread(int fileID, char* buf, int length);
+int sfs_fseek(int fileID, int loc);
+int sfs_remove(char* file);
+
+// directory listing with per-caller cursors
+int sfs_opendir();
+int sfs_readdir_batch(int dirID, DIRECTORY_LISTING* entries, int max_entries);
+int sfs_closedir(int dirID);
+
+// clones and snapshots sharing data blocks
+int sfs_clone(char* src, char* dst);
+int sfs_snapshot_create(char* name);
+int sfs_snapshot_delete(char* name);
+int sfs_snapshot_restore(char* name);
+
+// preallocation and truncation
+int sfs_fallocate(int fileID, int offset, int length);
+int sfs_ftruncate(int fileID, int length);
+
+// maintenance
+int sfs_fsck(int repair);
+int sfs_defragment();
+
+#endif